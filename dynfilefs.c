@@ -18,8 +18,10 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdint.h>
 #include <errno.h>
 #include <sys/mman.h>
+#include <sys/file.h>
 #include <fcntl.h>
 #include <pthread.h>
 #include <getopt.h>
@@ -27,6 +29,9 @@
 
 #define MAX_SPLIT_FILES 9999
 #define DATA_BLOCK_SIZE 4096
+#define BLOCK_LOCKS 256
+#define MAX_SCRUB_JOBS 64
+#define SCRUB_CHUNK_BLOCKS 1024
 
 char *dynfilefs_path = "/virtual.dat";
 char *storage_file = "";
@@ -40,12 +45,18 @@ off_t split_size_MB = 0;
 off_t increase_size_MB = 0;
 
 off_t format_version=400;
+off_t checksum_format_version=401;
 off_t virtual_size = 0;
 off_t split_size = 0;
 off_t header_size = DATA_BLOCK_SIZE;
 off_t offset_block_size = 0;
+off_t checksum_block_size = 0;
 
 int max_files = 1;
+int checksum = 0;
+int scrub = 0;
+int repair = 0;
+int scrub_jobs = 0;
 
 struct metaStruct
 {
@@ -63,6 +74,20 @@ FILE * mainfile;
 FILE * files[MAX_SPLIT_FILES] = {0};
 char * indexes[MAX_SPLIT_FILES] = {0};
 off_t last_block_offsets[MAX_SPLIT_FILES] = {0};
+char * checksums[MAX_SPLIT_FILES] = {0};
+pthread_rwlock_t block_locks[BLOCK_LOCKS];
+
+uint32_t crc32c_table[256];
+static uint32_t (*crc32c)(uint32_t crc, const char *buf, size_t size);
+
+struct scrubStruct
+{
+   pthread_mutex_t mutex;
+   off_t next_offset;
+   off_t blocks;
+   off_t errors;
+   off_t repaired;
+};
 
 
 static int with_unlock(int err)
@@ -71,12 +96,27 @@ static int with_unlock(int err)
    return err;
 }
 
-static int dynfilefs_fsync(const char *path, int isdatasync, struct fuse_file_info *fi)
+// in checksum mode the data must reach the disk before the checksums which cover it,
+// blocks written after the last sync may still fail verification after a crash
+//
+static int sync_storage(void)
 {
    for (int ix = 0; ix < max_files; ix++) fflush(files[ix]);
+   if (!checksum) return 0;
+
+   for (int ix = 0; ix < max_files; ix++)
+      if (fdatasync(fileno(files[ix])) != 0) return -errno;
+   for (int ix = 0; ix < max_files; ix++)
+      if (msync(indexes[ix], header_size + offset_block_size + checksum_block_size, MS_SYNC) != 0) return -errno;
+
    return 0;
 }
 
+static int dynfilefs_fsync(const char *path, int isdatasync, struct fuse_file_info *fi)
+{
+   return sync_storage();
+}
+
 static int dynfilefs_flush(const char *path, struct fuse_file_info *fi)
 {
    for (int ix = 0; ix < max_files; ix++) fflush(files[ix]);
@@ -154,6 +194,220 @@ static off_t create_data_offset(off_t offset)
    return last_block_offsets[ix];
 }
 
+// forget a block created by create_data_offset, called when its data could not be written
+static void clear_data_offset(off_t offset, off_t data_offset)
+{
+   off_t seek = 0;
+   off_t target = 0;
+   int ix = offset / split_size;
+
+   if (last_block_offsets[ix] == data_offset) last_block_offsets[ix] -= DATA_BLOCK_SIZE;
+
+   seek = header_size + (offset - split_size * ix) / DATA_BLOCK_SIZE * sizeof(offset);
+   memcpy(indexes[ix] + seek, &target, sizeof(target));
+}
+
+
+
+// CRC32C (Castagnoli), computed by the SSE4.2 crc32 instruction when the cpu has it,
+// otherwise by a lookup table
+//
+static uint32_t crc32c_sw(uint32_t crc, const char *buf, size_t size)
+{
+   crc = ~crc;
+   while (size--) crc = crc32c_table[(crc ^ (unsigned char)*buf++) & 0xff] ^ (crc >> 8);
+   return ~crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const char *buf, size_t size)
+{
+   unsigned long long c = ~crc;
+   unsigned long long v;
+
+   while (size >= sizeof(v))
+   {
+      memcpy(&v, buf, sizeof(v));
+      c = __builtin_ia32_crc32di(c, v);
+      buf += sizeof(v);
+      size -= sizeof(v);
+   }
+   while (size--) c = __builtin_ia32_crc32qi(c, *buf++);
+
+   return ~c;
+}
+#endif
+
+static void crc32c_init(void)
+{
+   for (uint32_t i = 0; i < 256; i++)
+   {
+      uint32_t crc = i;
+      for (int j = 0; j < 8; j++) crc = (crc >> 1) ^ (crc & 1 ? 0x82F63B78 : 0);
+      crc32c_table[i] = crc;
+   }
+
+   crc32c = crc32c_sw;
+#if defined(__x86_64__) && defined(__GNUC__)
+   __builtin_cpu_init();
+   if (__builtin_cpu_supports("sse4.2")) crc32c = crc32c_hw;
+#endif
+}
+
+// checksum of a full data block. The virtual block number is used as seed,
+// so an index entry pointing to a wrong block is detected too
+//
+static uint32_t block_checksum(off_t block_offset, const char *block)
+{
+   return crc32c(block_offset / DATA_BLOCK_SIZE, block, DATA_BLOCK_SIZE);
+}
+
+static uint32_t get_data_checksum(off_t offset)
+{
+   uint32_t crc = 0;
+   int ix = offset / split_size;
+
+   memcpy(&crc, checksums[ix] + (offset - split_size * ix) / DATA_BLOCK_SIZE * sizeof(crc), sizeof(crc));
+
+   return crc;
+}
+
+static void set_data_checksum(off_t offset, uint32_t crc)
+{
+   int ix = offset / split_size;
+
+   memcpy(checksums[ix] + (offset - split_size * ix) / DATA_BLOCK_SIZE * sizeof(crc), &crc, sizeof(crc));
+}
+
+// reads and checksums of a block are serialized against its writes,
+// so a reader never sees a half updated block
+//
+static pthread_rwlock_t * get_block_lock(off_t offset)
+{
+   return &block_locks[offset / DATA_BLOCK_SIZE % BLOCK_LOCKS];
+}
+
+// read full data block stored at data_offset and verify it against its checksum
+static int read_checksummed_block(off_t data_offset, off_t block_offset, char *block)
+{
+   int ix = block_offset / split_size;
+
+   off_t len = pread(fileno(files[ix]), block, DATA_BLOCK_SIZE, data_offset);
+   if (len < 0) return -errno;
+   memset(block + len, 0, DATA_BLOCK_SIZE - len);
+
+   if (block_checksum(block_offset, block) != get_data_checksum(block_offset))
+   {
+      fprintf(stderr, "checksum mismatch in block at offset %lli of %s (stored at %lli in %s.%i)\n", (long long)block_offset, dynfilefs_path, (long long)data_offset, storage_file, ix);
+      return -EIO;
+   }
+
+   return 0;
+}
+
+// unwritten blocks always have zero checksum, so a nonzero one means their index entry was lost
+static int lost_index_entry(off_t block_offset)
+{
+   fprintf(stderr, "missing index entry for block at offset %lli of %s\n", (long long)block_offset, dynfilefs_path);
+   return -EIO;
+}
+
+// read part of a single block in checksum mode
+static off_t read_checksummed(char *buf, off_t size, off_t offset)
+{
+   char block[DATA_BLOCK_SIZE];
+   off_t block_offset = offset - offset % DATA_BLOCK_SIZE;
+   pthread_rwlock_t *lock = get_block_lock(offset);
+   off_t data_offset;
+   int ret = 0;
+
+   pthread_rwlock_rdlock(lock);
+
+   data_offset = get_data_offset(offset);
+   if (data_offset != 0)
+   {
+      ret = read_checksummed_block(data_offset, block_offset, block);
+      if (ret == 0) memcpy(buf, block + offset % DATA_BLOCK_SIZE, size);
+   }
+   else if (get_data_checksum(block_offset) != 0)
+      ret = lost_index_entry(block_offset);
+   else
+      memset(buf, 0, size);
+
+   pthread_rwlock_unlock(lock);
+
+   return ret < 0 ? ret : size;
+}
+
+// write part of a single block in checksum mode. Partial writes are merged
+// with the verified old block content, so the checksum always covers full block
+//
+static off_t write_checksummed(const char *buf, off_t size, off_t offset)
+{
+   char block[DATA_BLOCK_SIZE];
+   const char *data = buf;
+   off_t block_offset = offset - offset % DATA_BLOCK_SIZE;
+   pthread_rwlock_t *lock = get_block_lock(offset);
+   off_t data_offset;
+   off_t len;
+   int created = 0;
+   int ret = 0;
+   int ix = offset / split_size;
+
+   pthread_rwlock_wrlock(lock);
+   pthread_mutex_lock(&dynfilefs_mutex);
+
+   data_offset = get_data_offset(offset);
+
+   // skip writing empty blocks if not already exist. Full empty block also heals
+   // a lost index entry, partial one is refused below like any other partial write
+   if (!memcmp(&empty, buf, size) && data_offset == 0)
+   {
+      if (size == DATA_BLOCK_SIZE) set_data_checksum(block_offset, 0);
+      if (get_data_checksum(block_offset) == 0)
+      {
+         pthread_mutex_unlock(&dynfilefs_mutex);
+         pthread_rwlock_unlock(lock);
+         return size;
+      }
+   }
+
+   if (data_offset == 0) { data_offset = create_data_offset(offset); created = 1; }
+
+   pthread_mutex_unlock(&dynfilefs_mutex);
+
+   if (data_offset == 0) ret = -ENOSPC; // write error, not enough free space
+   else if (size < DATA_BLOCK_SIZE)
+   {
+      if (created && get_data_checksum(block_offset) != 0) ret = lost_index_entry(block_offset);
+      else if (created) memset(block, 0, DATA_BLOCK_SIZE);
+      else ret = read_checksummed_block(data_offset, block_offset, block);
+      memcpy(block + offset % DATA_BLOCK_SIZE, buf, size);
+      data = block;
+   }
+
+   if (ret == 0)
+   {
+      len = pwrite(fileno(files[ix]), data, DATA_BLOCK_SIZE, data_offset);
+      if (len < 0) ret = -errno;
+      else if (len < DATA_BLOCK_SIZE) ret = -ENOSPC;
+      else set_data_checksum(block_offset, block_checksum(block_offset, data));
+   }
+
+   // do not leave a block without valid checksum in the index
+   if (ret < 0 && created)
+   {
+      pthread_mutex_lock(&dynfilefs_mutex);
+      clear_data_offset(offset, data_offset);
+      pthread_mutex_unlock(&dynfilefs_mutex);
+   }
+
+   pthread_rwlock_unlock(lock);
+
+   return ret < 0 ? ret : size;
+}
+
 
 
 static int dynfilefs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
@@ -172,15 +426,23 @@ static int dynfilefs_read(const char *path, char *buf, size_t size, off_t offset
         if (tot + rd > size) rd = size - tot;
         len = rd;
 
-        data_offset = get_data_offset(offset);
-        if (data_offset != 0)
+        if (checksum)
         {
-           len = pread(fileno(files[ix]), buf, rd, data_offset + (offset % DATA_BLOCK_SIZE));
-           if (len == 0) { len = rd; memset(buf, 0, len); }
-           if (len < 0) return -errno;
+           len = read_checksummed(buf, rd, offset);
+           if (len < 0) return len;
         }
         else
-           memset(buf, 0, len);
+        {
+           data_offset = get_data_offset(offset);
+           if (data_offset != 0)
+           {
+              len = pread(fileno(files[ix]), buf, rd, data_offset + (offset % DATA_BLOCK_SIZE));
+              if (len == 0) { len = rd; memset(buf, 0, len); }
+              if (len < 0) return -errno;
+           }
+           else
+              memset(buf, 0, len);
+        }
 
         tot += len;
         buf += len;
@@ -209,6 +471,16 @@ static int dynfilefs_write(const char *path, const char *buf, size_t size, off_t
        if (tot + wr > size) wr = size - tot;
        len=0;
 
+       if (checksum)
+       {
+          len = write_checksummed(buf, wr, offset);
+          if (len < 0) return len;
+          tot += len;
+          buf += len;
+          offset += len;
+          continue;
+       }
+
        pthread_mutex_lock(&dynfilefs_mutex);
 
        data_offset = get_data_offset(offset);
@@ -242,6 +514,7 @@ static int dynfilefs_write(const char *path, const char *buf, size_t size, off_t
 
 static void dynfilefs_destroy(void *fi)
 {
+   sync_storage();
    for (int ix = 0; ix < max_files; ix++)
    {
       fflush(files[ix]);
@@ -272,6 +545,110 @@ static int dynfilefs_chown(const char *path, uid_t uid, gid_t gid)
 }
 
 
+// offline verification of all stored blocks, each thread takes chunks of blocks in turn
+static void * scrub_worker(void *arg)
+{
+   struct scrubStruct *sc = arg;
+   char block[DATA_BLOCK_SIZE];
+   off_t data_start = header_size + offset_block_size + checksum_block_size;
+   off_t offset;
+   off_t end;
+   off_t data_offset;
+   off_t blocks = 0;
+   off_t errors = 0;
+   off_t repaired = 0;
+
+   while (1)
+   {
+      pthread_mutex_lock(&sc->mutex);
+      offset = sc->next_offset;
+      sc->next_offset += (off_t)SCRUB_CHUNK_BLOCKS * DATA_BLOCK_SIZE;
+      pthread_mutex_unlock(&sc->mutex);
+
+      if (offset >= virtual_size) break;
+      end = offset + (off_t)SCRUB_CHUNK_BLOCKS * DATA_BLOCK_SIZE;
+      if (end > virtual_size) end = virtual_size;
+
+      for (; offset < end; offset += DATA_BLOCK_SIZE)
+      {
+         data_offset = get_data_offset(offset);
+         if (data_offset == 0)
+         {
+            if (get_data_checksum(offset) == 0) continue;
+            lost_index_entry(offset);
+            if (repair) // the block reads as zeros from now on
+            {
+               set_data_checksum(offset, 0);
+               repaired++;
+            }
+            else errors++;
+            continue;
+         }
+
+         blocks++;
+
+         if (data_offset < data_start || data_offset > last_block_offsets[offset / split_size] || (data_offset - data_start) % DATA_BLOCK_SIZE != 0)
+         {
+            fprintf(stderr, "invalid index entry for block at offset %lli of %s (points to %lli in %s.%lli)\n", (long long)offset, dynfilefs_path, (long long)data_offset, storage_file, (long long)(offset / split_size));
+            errors++;
+         }
+         else if (read_checksummed_block(data_offset, offset, block) != 0)
+         {
+            if (repair) // accept current content of the block
+            {
+               set_data_checksum(offset, block_checksum(offset, block));
+               repaired++;
+            }
+            else errors++;
+         }
+      }
+   }
+
+   pthread_mutex_lock(&sc->mutex);
+   sc->blocks += blocks;
+   sc->errors += errors;
+   sc->repaired += repaired;
+   pthread_mutex_unlock(&sc->mutex);
+
+   return NULL;
+}
+
+static int scrub_storage(void)
+{
+   struct scrubStruct sc = {};
+   pthread_t threads[MAX_SCRUB_JOBS];
+   int jobs = scrub_jobs;
+
+   if (!checksum)
+   {
+      printf("Storage file %s was created without checksums, there is nothing to scrub.\n", storage_file);
+      return 1;
+   }
+
+   if (jobs <= 0) jobs = sysconf(_SC_NPROCESSORS_ONLN);
+   if (jobs <= 0) jobs = 1;
+   if (jobs > MAX_SCRUB_JOBS) jobs = MAX_SCRUB_JOBS;
+
+   pthread_mutex_init(&sc.mutex, NULL);
+   for (int i = 0; i < jobs; i++)
+   {
+      if (pthread_create(&threads[i], NULL, scrub_worker, &sc) != 0) { jobs = i; break; }
+   }
+   if (jobs == 0) scrub_worker(&sc);
+   for (int i = 0; i < jobs; i++) pthread_join(threads[i], NULL);
+
+   if (sc.repaired > 0 && sync_storage() != 0)
+   {
+      printf("cannot write repaired checksums to %s\n", storage_file);
+      return 1;
+   }
+
+   printf("Scrubbed %lli blocks of %s, found %lli errors, repaired %lli\n", (long long)sc.blocks, storage_file, (long long)(sc.errors + sc.repaired), (long long)sc.repaired);
+
+   return sc.errors > 0 ? 1 : 0;
+}
+
+
 static struct fuse_operations dynfilefs_oper = {
 	.getattr	= dynfilefs_getattr,
 	.readdir	= dynfilefs_readdir,
@@ -287,13 +664,30 @@ static struct fuse_operations dynfilefs_oper = {
 	.chown		= dynfilefs_chown,
 };
 
+// mounted storage is locked exclusively, scrub takes a shared lock (exclusive with repair),
+// so they never run on the same storage at the same time
+//
+static int lock_storage(void)
+{
+   int op = scrub && !repair ? LOCK_SH : LOCK_EX;
+
+   if (flock(fileno(mainfile), op | LOCK_NB) != 0)
+   {
+      printf("Storage file %s is in use by another dynfilefs process.\n", storage_file);
+      return 1;
+   }
+
+   return 0;
+}
+
 static void usage(char * cmd)
 {
        printf("\n");
        printf("%s\n", banner);
        printf("\n");
-       printf("usage: %s -f storage_file -m mount_dir [ -s size_MB ] [ -p split_size_MB ] [ -d ]\n", cmd);
+       printf("usage: %s -f storage_file -m mount_dir [ -s size_MB ] [ -p split_size_MB ] [ -c ] [ -d ]\n", cmd);
        printf("       %s -o[size=size_MB][split=split_size_MB] storage_file mount_dir\n", cmd);
+       printf("       %s -S -f storage_file [ -R ] [ -j jobs ]\n", cmd);
        printf("\n");
        printf("This command mounts a virtual filesystem to [mount_dir], creating a virtual file [mount_dir]/virtual.dat\n");
        printf("with a specified size in MB [size_MB]. All modifications to this virtual.dat file are then stored to disk,\n");
@@ -340,13 +734,37 @@ static void usage(char * cmd)
        printf("                           - This parameter is ignored if storage file exists,\n");
        printf("                             in that case the previous stored value is reused.\n");
        printf("\n");
+       printf("  --checksum\n");
+       printf("  -c                       - Store CRC32C checksum of each data block and verify it on every read.\n");
+       printf("                             Reads of a corrupted block fail with I/O error.\n");
+       printf("                             Storage created with checksums needs 4 more bytes per 4KB block,\n");
+       printf("                             that is about 3 MB instead of 2 MB overhead for each 1GB of data.\n");
+       printf("                           - This parameter is ignored if storage file exists,\n");
+       printf("                             checksums are used if the storage was created with them.\n");
+       printf("                           - Blocks written after the last fsync may fail verification\n");
+       printf("                             after a crash or power loss, use --scrub --repair to accept them.\n");
+       printf("\n");
+       printf("  --scrub\n");
+       printf("  -S                       - Do not mount, verify checksums of all blocks in storage_file instead.\n");
+       printf("                             Exits with nonzero status if any corrupted block was found.\n");
+       printf("                             Refuses to run while the storage is mounted.\n");
+       printf("\n");
+       printf("  --repair\n");
+       printf("  -R                       - With --scrub, store new checksum of each block which failed verification,\n");
+       printf("                             so it can be read again with its current (possibly damaged) content.\n");
+       printf("                             Blocks with lost index entry will read as zeros.\n");
+       printf("\n");
+       printf("  --jobs [jobs]\n");
+       printf("  -j [jobs]                - Number of parallel scrub threads, defaults to number of cpus.\n");
+       printf("\n");
        printf("Example usage:\n");
        printf("\n");
        printf("  # %s -f /tmp/changes.dat -s 1024 -m /mnt\n", cmd);
        printf("  # mke2fs -F /mnt/virtual.dat\n");
        printf("  # mount -o loop /mnt/virtual.dat /mnt\n");
        printf("\n");
-       printf("The [storage_file] has about 2 MB overhead for each 1GB of data (that is 0.2%%)\n");
+       printf("The [storage_file] has about 2 MB overhead for each 1GB of data (that is 0.2%%),\n");
+       printf("or about 3 MB for each 1GB of data (that is 0.3%%) when created with checksums\n");
        printf("\n");
 }
 
@@ -389,11 +807,15 @@ int main(int argc, char *argv[])
            {"mountdir",     required_argument, 0, 'm' },
            {"size",         required_argument, 0, 's' },
            {"split",        required_argument, 0, 'p' },
+           {"checksum",     no_argument,       0, 'c' },
+           {"scrub",        no_argument,       0, 'S' },
+           {"repair",       no_argument,       0, 'R' },
+           {"jobs",         required_argument, 0, 'j' },
            {"debug",        no_argument,       0, 'd' },
            {0,              0,                 0,  0 }
        };
 
-       int c = getopt_long(argcb, argvb, "f:o:m:s:p:d",long_options, &option_index);
+       int c = getopt_long(argcb, argvb, "f:o:m:s:p:cSRj:d",long_options, &option_index);
 
        if (c == -1){
            if (optind < argcb) {
@@ -457,6 +879,22 @@ int main(int argc, char *argv[])
                set_split_size_MB(optarg);
                break;
 
+           case 'c':
+               checksum = 1;
+               break;
+
+           case 'S':
+               scrub = 1;
+               break;
+
+           case 'R':
+               repair = 1;
+               break;
+
+           case 'j':
+               scrub_jobs = abs(strtol(optarg, NULL, 10));
+               break;
+
            case 'd':
                debug = 1;
            default:
@@ -470,12 +908,23 @@ int main(int argc, char *argv[])
     split_size = split_size_MB * 1024 * 1024;
     if (split_size <= 0) split_size = virtual_size;
 
+    crc32c_init();
+
+    // storage created with checksums uses different version, so older releases refuse it
+    off_t storage_version = checksum ? checksum_format_version : format_version;
+
     // open main file when it exists
-    mainfile = fopen(storage_file, "r+");
+    if (repair && !scrub) { usage(argv[0]); return 1; }
+    int readonly = scrub && !repair;
+
+    // scrub only reads the storage, it never changes it
+    mainfile = fopen(storage_file, readonly ? "r" : "r+");
     if (mainfile != NULL)
     {
        struct metaStruct meta = {};
 
+       if (lock_storage() != 0) return 1;
+
        // check version and other parameters
        fseeko(mainfile, meta_header_offset, SEEK_SET);
        ret = fread(&meta,sizeof(meta),1,mainfile);
@@ -484,15 +933,19 @@ int main(int argc, char *argv[])
           printf("cannot read header metadata from file %s\n", storage_file);
           return 1;
        }
-       if (meta.version != format_version)
+       if (meta.version != format_version && meta.version != checksum_format_version)
        {
           printf("The existing storage file %s is using incompatible data format version %lli. Current version is %lli. This is an error.\n", storage_file, (long long)meta.version, (long long)format_version);
           return 1;
        }
 
+       if (checksum && meta.version != checksum_format_version) printf("Storage file %s was created without checksums, checksums are not used.\n", storage_file);
+       checksum = meta.version == checksum_format_version;
+
+       storage_version=meta.version;
        split_size=meta.split_size;
        if (increase_size_MB > 0) virtual_size = meta.virtual_size + (increase_size_MB * 1024 * 1024);
-       if (virtual_size<=meta.virtual_size) virtual_size=meta.virtual_size;
+       if (virtual_size<=meta.virtual_size || scrub) virtual_size=meta.virtual_size;
 
        // if virtual size was changed, write it to main file
        if (meta.virtual_size!=virtual_size)
@@ -509,6 +962,7 @@ int main(int argc, char *argv[])
     }
     else // file does not exist yet, attempt to create it
     {
+       if (scrub) { printf("cannot open %s for scrubbing\n", storage_file); return 1; }
        if (virtual_size <= 0) { printf("You must provide virtual file size for new storage file.\n"); return 1; }
 
        mainfile = fopen(storage_file, "w+");
@@ -517,6 +971,7 @@ int main(int argc, char *argv[])
           printf("cannot open %s for writing\n", storage_file);
           return 1;
        }
+       if (lock_storage() != 0) return 1;
 
        // write full header (empty)
        fwrite(header,sizeof(header),1,mainfile);
@@ -526,7 +981,7 @@ int main(int argc, char *argv[])
        fwrite(banner,strlen(banner),1,mainfile);
 
        // write version to header
-       struct metaStruct meta = {version: format_version, split_size: split_size, virtual_size: virtual_size};
+       struct metaStruct meta = {version: storage_version, split_size: split_size, virtual_size: virtual_size};
        fseeko(mainfile, meta_header_offset, SEEK_SET);
        ret = fwrite(&meta,sizeof(meta),1,mainfile);
        if (ret < 0)
@@ -535,11 +990,14 @@ int main(int argc, char *argv[])
           return 1;
        }
     }
-    fclose(mainfile);
-    utime(storage_file,NULL);
+    fflush(mainfile); // stays open to hold the lock until we exit
+    if (!scrub) utime(storage_file,NULL);
 
     if (virtual_size > split_size) max_files = virtual_size / split_size + ( virtual_size % split_size > 0 ? 1 : 0);
     offset_block_size = split_size / DATA_BLOCK_SIZE * sizeof(off_t);
+    if (checksum) checksum_block_size = split_size / DATA_BLOCK_SIZE * sizeof(uint32_t);
+
+    for (int i = 0; i < BLOCK_LOCKS; i++) pthread_rwlock_init(&block_locks[i], NULL);
 
     if (max_files > MAX_SPLIT_FILES) { printf("Your settings would result in %i storage files, which is bigger than maximum of %i. Quit\n", max_files, MAX_SPLIT_FILES); return 1; }
 
@@ -551,7 +1009,7 @@ int main(int argc, char *argv[])
        sprintf(storage_file_path, "%s.%i", storage_file, i);
 
        // open existing changes file
-       files[i] = fopen(storage_file_path, "r+");
+       files[i] = fopen(storage_file_path, readonly ? "r" : "r+");
        if (files[i] != NULL)
        {
           struct metaStruct meta = {};
@@ -564,9 +1022,9 @@ int main(int argc, char *argv[])
              printf("cannot read header metadata from file %s\n", storage_file_path);
              return 1;
           }
-          if (meta.version != format_version)
+          if (meta.version != storage_version)
           {
-             printf("The existing storage file %s is using incompatible data format version %lli. Current version is %lli. This is an error.\n", storage_file_path, (long long)meta.version, (long long)format_version);
+             printf("The existing storage file %s is using incompatible data format version %lli. Current version is %lli. This is an error.\n", storage_file_path, (long long)meta.version, (long long)storage_version);
              return 1;
           }
 
@@ -576,7 +1034,7 @@ int main(int argc, char *argv[])
              return 1;
           }
 
-          if (meta.virtual_size!=virtual_size)
+          if (meta.virtual_size!=virtual_size && !scrub)
           {
              meta.virtual_size=virtual_size;
              fseeko(files[i], meta_header_offset, SEEK_SET);
@@ -590,13 +1048,14 @@ int main(int argc, char *argv[])
 
           // calculate new last_block_offsets after index of offsets
           fseeko(files[i], 0, SEEK_END);
-          off_t written_data_size = ftello(files[i]) - header_size - offset_block_size;
+          off_t written_data_size = ftello(files[i]) - header_size - offset_block_size - checksum_block_size;
           if (written_data_size < 0) written_data_size = 0;
           written_data_size += written_data_size % DATA_BLOCK_SIZE; // align to full block
-          last_block_offsets[i] = header_size + offset_block_size + written_data_size;
+          last_block_offsets[i] = header_size + offset_block_size + checksum_block_size + written_data_size;
        }
        else // file does not exist yet, attempt to create it
        {
+          if (scrub) { printf("cannot open %s for scrubbing\n", storage_file_path); return 1; }
           if (virtual_size <= 0) { printf("You must provide virtual file size for new storage file.\n"); return 1; }
 
           files[i] = fopen(storage_file_path, "w+");
@@ -614,7 +1073,7 @@ int main(int argc, char *argv[])
           fwrite(banner,strlen(banner),1,files[i]);
 
           // write version to header
-          struct metaStruct meta = {version: format_version, split_size: split_size, virtual_size: virtual_size};
+          struct metaStruct meta = {version: storage_version, split_size: split_size, virtual_size: virtual_size};
           fseeko(files[i], meta_header_offset, SEEK_SET);
           ret = fwrite(&meta,sizeof(meta),1,files[i]);
           if (ret < 0)
@@ -623,15 +1082,18 @@ int main(int argc, char *argv[])
              return 1;
           }
 
-          last_block_offsets[i] = header_size + offset_block_size;
+          last_block_offsets[i] = header_size + offset_block_size + checksum_block_size;
           fseeko(files[i],last_block_offsets[i] - 1, SEEK_SET);
           fwrite("\0",1,1,files[i]);
           fflush(files[i]);
        }
 
-       indexes[i] = mmap(NULL, header_size + offset_block_size, PROT_READ|PROT_WRITE, MAP_SHARED, fileno(files[i]), 0);
+       indexes[i] = mmap(NULL, header_size + offset_block_size + checksum_block_size, readonly ? PROT_READ : PROT_READ|PROT_WRITE, MAP_SHARED, fileno(files[i]), 0);
+       checksums[i] = indexes[i] + header_size + offset_block_size;
     }
 
+    if (scrub) return scrub_storage();
+
     // The following line ensures that the process is not killed by systemd
     // on shutdown, it is necessary to keep process running if root filesystem
     // is mounted using dynfilefs. Proper end of the process is umount, not kill.